@@ -0,0 +1,225 @@
+// Microbenchmarks for the coroutine primitives.
+// Prints one JSON object per line, so runs from different commits can be diffed or fed to a script.
+
+#include "../executor.h"
+#include "../generator.h"
+#include "../symmetric.h"
+#include <new>
+#include <cstdlib>
+
+namespace {
+    std::atomic<size_t> g_allocations {0};
+}
+
+void* operator new(std::size_t sz) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* ptr = std::malloc(sz)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+
+namespace {
+    // Runs `fn(ops)` a few times and reports the fastest, after a warm up run
+    template<class Fn>
+    void bench(const char* name, size_t ops, Fn&& fn) {
+        using clock = std::chrono::steady_clock;
+
+        constexpr int repetitions = 5;
+
+        fn(ops / 10 + 1);
+
+        double best_ns = std::numeric_limits<double>::max();
+        size_t allocations = 0;
+
+        for (int i = 0; i < repetitions; i++) {
+            auto allocations_before = g_allocations.load();
+            auto start = clock::now();
+
+            fn(ops);
+
+            auto ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+            auto run_allocations = g_allocations.load() - allocations_before;
+
+            // Both figures come from the same run
+            if (ns < best_ns) {
+                best_ns = ns;
+                allocations = run_allocations;
+            }
+        }
+
+        std::printf("{\"name\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}\n",
+            name, ops, best_ns / ops, double(allocations) / ops);
+    }
+
+
+
+    struct ResumePromise {
+        SimpleCoro<ResumePromise> get_return_object() {
+            return { coroutine_handle<ResumePromise>::from_promise(*this) };
+        }
+
+        auto initial_suspend() { return suspend_always{}; }
+        auto final_suspend() { return suspend_always{}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    SimpleCoro<ResumePromise> suspend_forever() {
+        while (true) {
+            co_await suspend_always{};
+        }
+    }
+
+
+    Task empty_task() {
+        co_return;
+    }
+
+    Task yield_n(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            co_await BasicAwaitable{};
+        }
+    }
+
+    // Completes without suspending, so only goes through the executor's queues when the budget runs out
+    Task expired_timer_n(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            co_await TimedAwaitable{0ms};
+        }
+    }
+
+    Task join_n(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            co_await join(BasicAwaitable{}, BasicAwaitable{}, BasicAwaitable{}, BasicAwaitable{},
+                BasicAwaitable{}, BasicAwaitable{}, BasicAwaitable{}, BasicAwaitable{});
+        }
+    }
+
+    void run_to_completion(Executor& executor) {
+        while (executor.run()) {}
+    }
+
+
+    Generator<size_t> iota(size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            co_yield i;
+        }
+    }
+
+
+    struct Token { std::string_view text; };
+
+    SymmetricCoroutine<std::string_view, int> lines(std::string_view line, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            co_yield line;
+        }
+    }
+
+    SymmetricCoroutine<Token, std::string_view> tokenize(std::string_view delimiters) {
+        auto data = co_yield Token {};
+
+        while (data) {
+            auto delim = data->find_first_of(delimiters);
+
+            if (delim != data->npos) {
+                data = co_yield Token { data->substr(0, delim+1) };
+            } else {
+                data = co_yield Token { *data };
+            }
+        }
+    }
+
+    SymmetricCoroutine<int, Token> count_tokens(size_t* count) {
+        while (auto token = co_yield 0) {
+            (*count)++;
+        }
+    }
+}
+
+
+int main() {
+    bench("simple_coro_resume", 10'000'000, [] (size_t ops) {
+        auto coro = suspend_forever();
+        for (size_t i = 0; i < ops; i++) {
+            coro.resume();
+        }
+    });
+
+    bench("executor_spawn_retire", 1'000'000, [] (size_t ops) {
+        Executor executor;
+        for (size_t i = 0; i < ops; i++) {
+            executor.spawn(empty_task());
+        }
+
+        run_to_completion(executor);
+    });
+
+    bench("executor_yield", 10'000'000, [] (size_t ops) {
+        Executor executor;
+        executor.spawn(yield_n(ops));
+        run_to_completion(executor);
+    });
+
+    bench("executor_wakeup", 10'000'000, [] (size_t ops) {
+        constexpr size_t num_tasks = 64;
+
+        Executor executor;
+        for (size_t i = 0; i < num_tasks; i++) {
+            executor.spawn(yield_n(ops / num_tasks));
+        }
+
+        run_to_completion(executor);
+    });
+
+    bench("executor_ready_await", 10'000'000, [] (size_t ops) {
+        Executor executor;
+        executor.spawn(expired_timer_n(ops));
+        run_to_completion(executor);
+    });
+
+    bench("join_fanout_8", 1'000'000, [] (size_t ops) {
+        Executor executor;
+        executor.spawn(join_n(ops));
+        run_to_completion(executor);
+    });
+
+    bench("generator_element", 10'000'000, [] (size_t ops) {
+        size_t sum = 0;
+        for (auto value : iota(ops)) {
+            sum += value;
+        }
+
+        if (sum != ops * (ops - 1) / 2) {
+            std::abort();
+        }
+    });
+
+    bench("symmetric_token", 10'000'000, [] (size_t ops) {
+        // Control passes round the ring once per line, carrying its first token to the sink
+        size_t count = 0;
+
+        auto source = lines("token.", ops);
+        auto tokens = tokenize(".!?");
+        auto sink = count_tokens(&count);
+
+        sink.run();
+        tokens.run();
+
+        source.set_target(tokens.handle());
+        tokens.set_target(sink.handle());
+        sink.set_target(source.handle());
+
+        while (source.run()) {}
+
+        if (count != ops) {
+            std::abort();
+        }
+    });
+}
@@ -0,0 +1,7 @@
+#!/bin/bash
+
+cd "$(dirname "$0")"
+
+flags="-std=c++2a -O2 -DNDEBUG -Wall -Wextra -fcoroutines-ts -stdlib=libc++ -lpthread"
+
+clang++ $flags bench.cpp -obench && ./bench
@@ -2,4 +2,6 @@
 
 flags="-std=c++2a -g -Wall -Wextra -fcoroutines-ts -stdlib=libc++ -lpthread"
 
+# Add -DCORO_TRACING to record executor events for test_executor_trace
+
 clang++ $flags *.cpp -obuild && ./build
\ No newline at end of file
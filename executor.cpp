@@ -1,249 +1,413 @@
-#include "common.h"
-#include <vector>
-#include <mutex>
-#include <array>
+#include "executor.h"
+#include <cmath>
 
 namespace {
-    struct TaskPromise;
-    using Task = SimpleCoro<TaskPromise>;
+    Task basic(int x) {
+        std::printf("[basic %d] begin\n", x);
 
-    struct Executor {
-        std::vector<Task> m_owned_tasks;
+        for (int i = 0; i < x; i++) {
+            co_await BasicAwaitable{};
+        }
 
-        std::vector<coroutine_handle<>> m_needs_waking;
-        std::vector<coroutine_handle<>> m_currently_waking;
-        std::mutex needs_waking_mutex;
+        std::printf("[basic %d] end\n", x);
+    }
 
-        void spawn(Task task) {
-            m_needs_waking.push_back(task.handle());
-            m_owned_tasks.push_back(std::move(task));
-        }
 
-        void wakeup(coroutine_handle<> handle) {
-            std::unique_lock guard {needs_waking_mutex};
-            m_needs_waking.push_back(handle);
-        }
+    Task timed(int x) {
+        std::printf("[timed %d] begin\n", x);
 
-        bool run() {
-            {
-                std::unique_lock guard {needs_waking_mutex};
-                std::swap(m_needs_waking, m_currently_waking);
-            }
+        co_await TimedAwaitable{1500ms * x};
 
-            for (auto handle : m_currently_waking) {
-                if (!handle || handle.done()) {
-                    continue;
-                }
+        std::printf("[timed %d] end\n", x);
+    }
 
-                handle.resume();
-            }
 
-            m_currently_waking.clear();
+    Task counter() {
+        std::puts("[counter] begin");
 
-            std::erase_if(m_owned_tasks, [] (auto&& task) {
-                return !task.handle() || task.handle().done();
-            });
+        std::puts("[counter] joining with no args");
+        co_await join();
 
-            return !m_owned_tasks.empty();
-        }
-    };
+        std::puts("[counter] joining with three args");
+        co_await join(BasicAwaitable{}, TimedAwaitable{500ms}, TimedAwaitable{1000ms});
+
+        std::puts("[counter] end");
+    }
 
-    static Executor* g_executor;
 
-    struct TaskPromise {
-        Task get_return_object() {
-            return { coroutine_handle<TaskPromise>::from_promise(*this) };
+    Task nursery(int x) {
+        std::printf("[nursery %d] begin\n", x);
+
+        AsyncScope scope {2};
+
+        for (int i = 0; i < x; i++) {
+            std::printf("[nursery %d] spawning child %d\n", x, i);
+            co_await scope.spawn(basic(i));
         }
 
-        auto initial_suspend() { return suspend_always{}; }
-        auto final_suspend() { return suspend_always{}; }
-        void return_void() {}
-        void unhandled_exception() { std::terminate(); }
-    };
+        std::printf("[nursery %d] joining\n", x);
+        co_await scope.join();
 
+        std::printf("[nursery %d] end\n", x);
+    }
 
 
+    Task hop(ShardedExecutor* shards, int x) {
+        for (int i = 0; i < 3; i++) {
+            int shard = shards->index_of(current_executor());
+            std::printf("[hop %d] on shard %d\n", x, shard);
 
-    struct JoinCounter {
-        JoinCounter(int c) : count{c} {}
+            co_await TimedAwaitable{10ms};
+            std::printf("[hop %d] woken on shard %d\n", x, shards->index_of(current_executor()));
 
-        bool is_ready() const { return (bool) to_resume; }
-        bool try_await(coroutine_handle<> h) {
-            to_resume = h;
-            return count > 0;
+            co_await migrate_to(shards->shard((shard + 1) % shards->num_shards()));
         }
 
-        void notify_completed() {
-            count--;
-            if (count == 0) {
-                g_executor->wakeup(to_resume);
-            }
-        }
+        std::printf("[hop %d] end on shard %d\n", x, shards->index_of(current_executor()));
+    }
 
-        int count;
-        coroutine_handle<> to_resume {};
-    };
 
-    struct JoinTask;
+    template<class Fn>
+    Task transform_and_sum(std::vector<double>* values, Fn fn, double* sum, std::chrono::steady_clock::duration* time) {
+        auto start = std::chrono::steady_clock::now();
 
-    struct JoinPromise {
-        JoinTask get_return_object();
+        co_await parallel_for(*values, 1 << 14, [fn] (double& v) { v = fn(v); });
+        *sum = co_await parallel_reduce(*values, 1 << 14, 0.0, std::plus<>{});
 
-        auto initial_suspend() { return suspend_always{}; }
-        auto final_suspend() {
-            struct Awaitable {
-                bool await_ready() { return false; }
+        *time = std::chrono::steady_clock::now() - start;
+    }
 
-                void await_suspend(coroutine_handle<JoinPromise> h) {
-                    h.promise().counter->notify_completed();
-                }
+}
 
-                void await_resume() {}
-            };
 
-            return Awaitable{};
-        }
-        void return_void() {}
-        void unhandled_exception() { std::terminate(); }
 
-        JoinCounter* counter {nullptr};
-    };
+void test_executor() {
+    TestScope scope {"test_executor"};
 
-    struct JoinTask {
-        using promise_type = JoinPromise;
+    Executor executor;
 
-        JoinTask(coroutine_handle<JoinPromise> h) : handle{h} {}
+    executor.spawn(basic(3));
 
-        void start(JoinCounter* counter) {
-            handle.promise()->counter = counter;
-            handle.resume();
-        }
+    executor.spawn(timed(0));
+    executor.spawn(timed(2));
 
-        OwnedHandle<JoinPromise> handle;
-    };
+    executor.spawn(counter());
 
-    JoinTask JoinPromise::get_return_object() {
-        return { coroutine_handle<JoinPromise>::from_promise(*this) };
+    while (executor.run()) {
+        std::puts("...");
+        executor.park();
     }
+}
+
 
+void test_executor_nursery() {
+    TestScope scope {"test_executor_nursery"};
 
-    template<class Awaitable>
-    JoinTask make_join_task(Awaitable&& awaitable) {
-        co_await std::forward<Awaitable>(awaitable);
+    Executor executor;
+
+    executor.spawn(nursery(4));
+
+    while (executor.run()) {
+        executor.park();
     }
+}
 
 
-    template<int N>
-    struct JoinAwaitable {
-        JoinAwaitable(std::array<JoinTask, N> ts)
-            : tasks{std::move(ts)}
-            , counter{N}
-        {}
+namespace {
+    Task background_load(int const* probes_running) {
+        using clock = std::chrono::steady_clock;
 
-        bool await_ready() { return counter.is_ready(); }
+        while (*probes_running > 0) {
+            // Simulate a chunk of bulk work between yields
+            auto until = clock::now() + 20us;
+            while (clock::now() < until) {}
 
-        bool await_suspend(coroutine_handle<> h) {
-            for (auto&& task : tasks) {
-                task.start(&counter);
-            }
+            co_await BasicAwaitable{};
+        }
+    }
 
-            return counter.try_await(h);
+    Task latency_probe(int samples, int* probes_running, std::vector<ExecutorClock::duration>* lateness) {
+        for (int i = 0; i < samples; i++) {
+            auto deadline = current_executor().now() + 2ms;
+            co_await TimedAwaitable{2ms};
+            lateness->push_back(current_executor().now() - deadline);
         }
 
-        void await_resume() {}
+        (*probes_running)--;
+    }
+}
 
-        std::array<JoinTask, N> tasks;
-        JoinCounter counter;
-    };
 
-    template<class... Awaitable>
-    auto join(Awaitable&&... awaitable) {
-        return JoinAwaitable<sizeof...(Awaitable)> {{
-            make_join_task(std::forward<Awaitable>(awaitable)) ...
-        }};
+void test_sharded_executor() {
+    TestScope scope {"test_sharded_executor"};
+
+    ShardedExecutor shards;
+    std::printf("%d shards\n", shards.num_shards());
+
+    for (int i = 0; i < 4; i++) {
+        shards.spawn(hop(&shards, i));
     }
 
+    shards.run();
+}
+
 
+void test_parallel() {
+    TestScope scope {"test_parallel"};
 
+    using clock = std::chrono::steady_clock;
 
-    struct BasicAwaitable {
-        bool await_ready() { return false; }
-        void await_suspend(coroutine_handle<> h) {
-            g_executor->wakeup(h);
+    std::vector<double> values(1 << 22);
+    std::iota(values.begin(), values.end(), 0.0);
+
+    auto work = [] (double x) {
+        for (int i = 0; i < 16; i++) {
+            x = std::sqrt(x + i);
         }
-        void await_resume() {}
+        return x;
     };
 
-    struct TimedAwaitable {
-        using clock = std::chrono::high_resolution_clock;
+    // Same two passes as transform_and_sum, on a copy since that transforms values in place
+    std::vector<double> serial_values = values;
 
-        clock::time_point when;
+    auto serial_start = clock::now();
+    std::transform(serial_values.begin(), serial_values.end(), serial_values.begin(), work);
+    double serial_sum = std::accumulate(serial_values.begin(), serial_values.end(), 0.0);
+    auto serial_time = clock::now() - serial_start;
 
-        TimedAwaitable(clock::duration d) : when{clock::now() + d} {}
+    ShardedExecutor shards;
 
-        bool await_ready() { return when <= clock::now(); }
-        void await_suspend(coroutine_handle<> h) {
-            std::thread([h, when=this->when] () mutable {
-                std::this_thread::sleep_until(when);
-                g_executor->wakeup(h);
-            }).detach();
-        }
-        void await_resume() {}
-    };
+    double parallel_sum = 0.0;
+    auto parallel_time = clock::duration{};
 
+    shards.spawn(transform_and_sum(&values, work, &parallel_sum, &parallel_time));
+    shards.run();
 
+    auto ms = [] (clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::printf("[parallel] %d shards\n", shards.num_shards());
+    std::printf("[parallel] serial   %.1fms  sum %f\n", ms(serial_time), serial_sum);
+    std::printf("[parallel] parallel %.1fms  sum %f  speedup %.2fx\n", ms(parallel_time), parallel_sum, ms(serial_time) / ms(parallel_time));
+}
+
+
+// Runs the test_executor and test_executor_nursery workloads against a simulated clock - seconds of timers take
+// no wall time, and the interleaving is the same on every run
+void test_executor_simulated() {
+    TestScope scope {"test_executor_simulated"};
+
+    auto wall_start = std::chrono::steady_clock::now();
+
+    Executor executor {ExecutorClock::simulated(), 1234};
+    auto start = executor.now();
+
+    executor.spawn(basic(3));
+
+    executor.spawn(timed(0));
+    executor.spawn(timed(2));
+
+    executor.spawn(counter());
+
+    executor.spawn(nursery(4));
+
+    while (executor.run()) {}
+
+    auto ms = [] (auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::printf("[simulated] %.1fms simulated in %.3fms\n", ms(executor.now() - start), ms(std::chrono::steady_clock::now() - wall_start));
+}
 
-    Task basic(int x) {
-        std::printf("[basic %d] begin\n", x);
 
+namespace {
+    Task ticker(int x) {
         for (int i = 0; i < x; i++) {
-            co_await BasicAwaitable{};
+            co_await TimedAwaitable{20ms};
         }
+    }
 
-        std::printf("[basic %d] end\n", x);
+    Task churn(int x) {
+        AsyncScope scope {4};
+
+        for (int i = 0; i < x; i++) {
+            co_await scope.spawn(ticker(5));
+            co_await join(BasicAwaitable{}, BasicAwaitable{});
+        }
+
+        co_await scope.join();
     }
+}
 
 
-    Task timed(int x) {
-        std::printf("[timed %d] begin\n", x);
+void test_executor_metrics() {
+    TestScope scope {"test_executor_metrics"};
 
-        co_await TimedAwaitable{1500ms * x};
+    Executor executor;
 
-        std::printf("[timed %d] end\n", x);
+    for (int i = 0; i < 8; i++) {
+        executor.spawn(ticker(10));
     }
 
+    executor.spawn(churn(40));
 
-    Task counter() {
-        std::puts("[counter] begin");
+    auto previous = executor.metrics();
 
-        std::puts("[counter] joining with no args");
-        co_await join();
+    while (executor.run()) {
+        std::this_thread::sleep_for(50ms);
 
-        std::puts("[counter] joining with three args");
-        co_await join(BasicAwaitable{}, TimedAwaitable{500ms}, TimedAwaitable{1000ms});
+        auto metrics = executor.metrics();
+        std::printf("[metrics] ready %3zu  live %3zu  %8.0f resumes/s  wakeup latency p50 <%6luns p99 <%6luns\n",
+            metrics.ready_queue_depth, metrics.live_tasks, metrics.resumes_per_second(previous),
+            latency_percentile_ns(metrics.wakeup_latency, 0.5), latency_percentile_ns(metrics.wakeup_latency, 0.99));
 
-        std::puts("[counter] end");
+        previous = metrics;
     }
 
+    auto frames = frame_metrics();
+    for (int type = 0; type < k_num_frame_types; type++) {
+        std::printf("[metrics] %s frames: %lu allocated (%lu bytes), %lu live (%lu bytes)\n", k_frame_type_names[type],
+            frames[type].allocations, frames[type].bytes_allocated, frames[type].live_frames(), frames[type].live_bytes());
+    }
 }
 
 
+// Writes a Chrome trace of the test_executor and test_sharded_executor workloads to executor_trace.json
+void test_executor_trace() {
+    TestScope scope {"test_executor_trace"};
 
-void test_executor() {
-    TestScope scope {"test_executor"};
+#ifdef CORO_TRACING
+    {
+        Executor executor;
+
+        executor.spawn(basic(20));
+        executor.spawn(timed(0));
+        executor.spawn(counter());
+        executor.spawn(nursery(4));
+
+        while (executor.run()) {
+            executor.park();
+        }
+    }
+
+    {
+        ShardedExecutor shards;
+        for (int i = 0; i < 4; i++) {
+            shards.spawn(hop(&shards, i));
+        }
+
+        shards.run();
+    }
+
+    if (auto file = std::fopen("executor_trace.json", "w")) {
+        dump_chrome_trace(file);
+        std::fclose(file);
+        std::puts("wrote executor_trace.json");
+    }
+#else
+    std::puts("tracing is compiled out - build with -DCORO_TRACING");
+#endif
+}
+
+
+// Measures how late probe tasks are resumed after their timers fire while the executor is saturated with background work.
+void test_executor_priority() {
+    TestScope scope {"test_executor_priority"};
+
+    constexpr int num_background_tasks = 64;
+    constexpr int num_probes = 4;
+    constexpr int samples_per_probe = 50;
+
+    for (auto [probe_priority, name] : {std::pair{Priority::Latency, "latency"}, std::pair{Priority::Background, "background"}}) {
+        Executor executor;
+
+        int probes_running = num_probes;
+        std::vector<ExecutorClock::duration> lateness;
+        lateness.reserve(num_probes * samples_per_probe);
+
+        for (int i = 0; i < num_background_tasks; i++) {
+            executor.spawn(background_load(&probes_running), Priority::Background);
+        }
+
+        for (int i = 0; i < num_probes; i++) {
+            executor.spawn(latency_probe(samples_per_probe, &probes_running, &lateness), probe_priority);
+        }
+
+        while (executor.run()) {}
+
+        std::sort(lateness.begin(), lateness.end());
+
+        auto percentile_us = [&] (double p) {
+            auto idx = std::min(lateness.size() - 1, size_t(p * lateness.size()));
+            return std::chrono::duration<double, std::micro>(lateness[idx]).count();
+        };
+
+        std::printf("[priority] %-10s probes: p50 %8.1fus  p99 %8.1fus  max %8.1fus\n",
+            name, percentile_us(0.5), percentile_us(0.99), percentile_us(1.0));
+    }
+}
+
+
+namespace {
+    // Passes control back and forth between whichever two tasks are waiting on it
+    struct Baton {
+        struct PassAwaitable {
+            Baton* baton;
+
+            bool await_ready() { return false; }
+
+            template<class Promise>
+            void await_suspend(coroutine_handle<Promise> h) {
+                if (auto other = std::exchange(baton->waiting, h)) {
+                    schedule(other);
+                }
+            }
+            void await_resume() {}
+        };
+
+        PassAwaitable pass() { return {this}; }
+
+        void release() {
+            if (auto other = std::exchange(waiting, {})) {
+                schedule(other);
+            }
+        }
+
+        Runnable waiting {};
+    };
+
+    Task ping_pong(const char* name, Baton* baton, int passes) {
+        for (int i = 0; i < passes; i++) {
+            std::printf("[%s] %d\n", name, i);
+            co_await baton->pass();
+        }
+
+        baton->release();
+    }
+
+    Task bystander(int x) {
+        for (int i = 0; i < x; i++) {
+            std::printf("[bystander] %d\n", i);
+            co_await BasicAwaitable{};
+        }
+    }
+}
+
+
+// Two tasks waking each other run back to back through the next slot, until the chain limit sends them back to
+// the queues and the bystander gets a turn. A JoinTask yielding inside its parent goes to the back of the queue.
+void test_executor_handoff() {
+    TestScope scope {"test_executor_handoff"};
 
     Executor executor;
-    g_executor = &executor;
 
-    executor.spawn(basic(3));
+    Baton baton;
+    executor.spawn(ping_pong("ping", &baton, 12));
+    executor.spawn(ping_pong("pong", &baton, 12));
+    executor.spawn(bystander(4));
 
-    executor.spawn(timed(0));
-    executor.spawn(timed(2));
+    while (executor.run()) {}
 
     executor.spawn(counter());
+    executor.spawn(bystander(2));
 
     while (executor.run()) {
-        std::puts("...");
-        std::this_thread::sleep_for(500ms);
+        executor.park();
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,1098 @@
+#pragma once
+
+#include "common.h"
+#include "trace.h"
+#include "metrics.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <array>
+#include <deque>
+#include <atomic>
+#include <queue>
+#include <tuple>
+#include <random>
+#include <cassert>
+
+struct TaskPromise;
+using Task = SimpleCoro<TaskPromise>;
+
+enum class Priority {
+    Latency,
+    Normal,
+    Background,
+};
+
+constexpr int k_num_priorities = 3;
+
+// How many ready handles of each class are resumed per scheduling round, highest priority first.
+// Every class gets at least one slot per round, so a busy latency class slows background work down but never starves it.
+// Slots an empty class doesn't use go to the classes below it.
+constexpr std::array<int, k_num_priorities> k_priority_weights {8, 4, 1};
+
+// How many awaits a task may complete without actually suspending (an expired timer, a free scope slot, a join
+// whose children all finished inline) before it is preempted to the back of its queue.
+constexpr int k_task_budget = 16;
+
+// How many handles may be run back to back through the next slot before the chain is sent back to the queues,
+// so a pair of tasks waking each other can't hog a tick.
+constexpr int k_max_next_chain = 8;
+
+struct Executor;
+struct ShardedExecutor;
+
+// State shared by every promise type the executor knows how to schedule
+struct ScheduledPromise {
+    Priority priority {Priority::Normal};
+    int budget {k_task_budget};
+
+    // The executor the coroutine belongs to - it is always woken here, so it keeps running on the same shard
+    Executor* executor {nullptr};
+
+    // When it was last woken, for the wakeup latency histogram - the current round if woken from its executor's
+    // own thread
+    std::chrono::steady_clock::time_point woken_at {};
+};
+
+// A handle waiting to be resumed, along with the scheduling state of its promise
+struct Runnable {
+    Runnable() = default;
+
+    template<class Promise>
+    Runnable(coroutine_handle<Promise> h) : handle{h}, promise{&h.promise()} {}
+
+    explicit operator bool() const { return (bool) handle; }
+
+    coroutine_handle<> handle {};
+    ScheduledPromise* promise {nullptr};
+};
+
+// Time as seen by an executor's timers. A simulated clock only moves when the executor runs out of ready work,
+// at which point it jumps straight to the next timer deadline - so timer heavy workloads run as fast as the CPU allows.
+struct ExecutorClock {
+    using time_point = std::chrono::steady_clock::time_point;
+    using duration = std::chrono::steady_clock::duration;
+
+    static ExecutorClock real() { return {}; }
+    static ExecutorClock simulated(time_point start = {}) { return {true, start}; }
+
+    time_point now() const {
+        return m_simulated? m_simulated_now : std::chrono::steady_clock::now();
+    }
+
+    bool is_simulated() const { return m_simulated; }
+
+    void advance_to(time_point when) {
+        m_simulated_now = std::max(m_simulated_now, when);
+    }
+
+    bool m_simulated {false};
+    time_point m_simulated_now {};
+};
+
+struct Timer {
+    ExecutorClock::time_point when;
+    // Breaks ties between timers with the same deadline, so they fire in the order they were added
+    uint64_t sequence;
+    Runnable runnable;
+
+    bool operator>(Timer const& o) const {
+        return std::tie(when, sequence) > std::tie(o.when, o.sequence);
+    }
+};
+
+// The executor currently inside run() on this thread, if any
+inline thread_local Executor* t_current_executor;
+
+// Only valid inside a task. Awaitables should go by the executor stored in the awaiting promise instead.
+inline Executor& current_executor() {
+    assert(t_current_executor);
+    return *t_current_executor;
+}
+
+struct Executor {
+    Executor() = default;
+
+    // With a seed, handles that become ready in the same round are resumed in a shuffled but reproducible order.
+    // Together with a simulated clock this makes a run deterministic, so scheduling dependent bugs can be replayed.
+    Executor(ExecutorClock clock, std::optional<uint64_t> seed = std::nullopt)
+        : m_clock{clock}
+    {
+        if (seed) {
+            m_shuffle_rng.emplace(*seed);
+        }
+    }
+
+    std::vector<Task> m_owned_tasks;
+
+    // Live tasks owned by this executor, including ones adopted from other threads but not yet collected
+    std::atomic<size_t> m_num_tasks {0};
+
+    // The sharded executor this is a shard of, if any
+    ShardedExecutor* m_group {nullptr};
+
+    std::array<std::vector<Runnable>, k_num_priorities> m_needs_waking;
+    std::array<std::deque<Runnable>, k_num_priorities> m_ready;
+    std::vector<Task> m_incoming_tasks;
+    std::mutex needs_waking_mutex;
+
+    // Signalled when a handle or task is queued while the thread in run() is blocked in park().
+    // Guarded by needs_waking_mutex.
+    std::condition_variable m_wakeup_signal;
+    bool m_parked {false};
+
+    // Only written by the thread in run(), read by metrics() from anywhere
+    std::atomic<size_t> m_num_ready {0};
+    std::atomic<uint64_t> m_resumes {0};
+    std::array<std::atomic<uint64_t>, k_latency_buckets> m_wakeup_latency {};
+
+    // Taken once per scheduling round by the thread in run(). Wakeups from that thread and resumes are timed
+    // against it rather than reading the clock themselves, so wakeup latency is only as fine grained as a round.
+    // Only touched by the thread in run() - see wakeup_time().
+    std::chrono::steady_clock::time_point m_round_start {};
+
+    // Timers are only added by tasks running on this executor, so are only touched by the thread in run()
+    ExecutorClock m_clock {};
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> m_timers;
+    uint64_t m_next_timer_sequence {0};
+
+    std::optional<std::mt19937_64> m_shuffle_rng;
+
+    // The handle being resumed, and the most recent handle it woke. The woken handle is run as soon as the
+    // current one suspends, while the state they share is still warm in cache. Only touched by the thread in run().
+    Runnable m_current {};
+    Runnable m_next {};
+
+    void spawn(Task task, Priority priority = Priority::Normal);
+
+    // Take ownership of a task and queue it. Safe to call from any thread.
+    void adopt(Task task);
+
+    // Hand a suspended task over to another executor, which owns and runs it from then on.
+    // Must be called from the thread running this executor. Returns false, leaving the task where it is, if it
+    // isn't one of ours.
+    bool migrate(coroutine_handle<> handle, Executor& target) {
+        auto it = std::find_if(m_owned_tasks.begin(), m_owned_tasks.end(), [handle] (auto&& task) {
+            return task.handle() == handle;
+        });
+
+        if (it == m_owned_tasks.end()) {
+            return false;
+        }
+
+        auto task = std::move(*it);
+        m_owned_tasks.erase(it);
+
+        // Adopt before dropping our count, so the task is never missing from both
+        target.adopt(std::move(task));
+        m_num_tasks--;
+        return true;
+    }
+
+    // Queue a handle belonging to this executor. Safe to call from any thread.
+    void wakeup(Runnable runnable) {
+        // Handing off mustn't let lower priority work jump ahead of higher priority work - neither the running
+        // task's nor whatever's already in the next slot. Tasks yielding go through requeue instead, but the
+        // running task can still end up woken through here.
+        bool direct_handoff = t_current_executor == this
+            && m_current
+            && runnable.handle != m_current.handle
+            && runnable.promise->priority <= m_current.promise->priority
+            && (!m_next || runnable.promise->priority <= m_next.promise->priority);
+
+        if (!direct_handoff) {
+            requeue(runnable);
+            return;
+        }
+
+        CORO_TRACE(Enqueue, runnable.handle);
+        runnable.promise->woken_at = wakeup_time();
+
+        // The previous occupant is displaced to the regular queues
+        if (auto displaced = std::exchange(m_next, runnable)) {
+            enqueue(displaced);
+        }
+    }
+
+    // When a handle being woken now started waiting. Another thread can't go by the current round, since this
+    // executor may be parked with a round from before it went to sleep - but it's about to take the lock anyway,
+    // so a clock read is cheap in comparison.
+    std::chrono::steady_clock::time_point wakeup_time() const {
+        if (t_current_executor == this) {
+            return m_round_start;
+        }
+
+        return std::chrono::steady_clock::now();
+    }
+
+    // Queue a handle at the back of its queue, never through the next slot. Safe to call from any thread.
+    void requeue(Runnable runnable) {
+        CORO_TRACE(Enqueue, runnable.handle);
+        runnable.promise->woken_at = wakeup_time();
+
+        enqueue(runnable);
+    }
+
+    void enqueue(Runnable runnable) {
+        std::unique_lock guard {needs_waking_mutex};
+        m_needs_waking[(int) runnable.promise->priority].push_back(runnable);
+
+        if (m_parked) {
+            m_wakeup_signal.notify_one();
+        }
+    }
+
+    ExecutorClock::time_point now() const {
+        return m_clock.now();
+    }
+
+    void add_timer(ExecutorClock::time_point when, Runnable runnable) {
+        m_timers.push({when, m_next_timer_sequence++, runnable});
+    }
+
+    bool run() {
+        t_current_executor = this;
+
+        m_round_start = std::chrono::steady_clock::now();
+        fire_timers();
+        collect_wakeups();
+
+        // Nothing can happen before the next deadline, so skip straight to it
+        if (m_clock.is_simulated() && !has_ready() && !m_timers.empty()) {
+            m_clock.advance_to(m_timers.top().when);
+            fire_timers();
+            collect_wakeups();
+        }
+
+        // Only resume as many handles as were ready at the start of the tick, so tasks that keep rewaking
+        // themselves can't keep us in here forever. Timers and wakeups are collected between rounds so that
+        // latency work woken during the tick can overtake background work that's still queued.
+        size_t to_resume = 0;
+        for (auto&& queue : m_ready) {
+            to_resume += queue.size();
+        }
+
+        while (to_resume > 0 && has_ready()) {
+            // Slots a class leaves unused roll down to the classes below it, so every round is a full batch while
+            // there's work - otherwise a lone background task would pay for collecting wakeups on every resume
+            int slots = 0;
+
+            for (int priority = 0; priority < k_num_priorities; priority++) {
+                auto& queue = m_ready[priority];
+                slots += k_priority_weights[priority];
+
+                for (; slots > 0 && !queue.empty() && to_resume > 0; slots--) {
+                    auto runnable = queue.front();
+                    queue.pop_front();
+                    to_resume--;
+
+                    resume(runnable);
+                }
+            }
+
+            // Anything else waits for the next tick, which fires and collects first thing anyway
+            if (to_resume == 0) {
+                break;
+            }
+
+            m_round_start = std::chrono::steady_clock::now();
+            fire_timers();
+            collect_wakeups();
+        }
+
+        size_t num_ready = 0;
+        for (auto&& queue : m_ready) {
+            num_ready += queue.size();
+        }
+        m_num_ready.store(num_ready, std::memory_order_relaxed);
+
+        t_current_executor = nullptr;
+
+        size_t retired = std::erase_if(m_owned_tasks, [] (auto&& task) {
+            return !task.handle() || task.handle().done();
+        });
+
+        if (retired > 0) {
+            m_num_tasks -= retired;
+            retire_from_group(retired);
+        }
+
+        return m_num_tasks > 0;
+    }
+
+    // Blocks the calling thread until there may be something to run - a handle or task queued from another
+    // thread, or the next timer deadline. Returns straight away if anything is ready already. Must be called from
+    // the thread that calls run(), between runs.
+    void park();
+
+    // When the earliest pending timer fires, if there are any
+    std::optional<ExecutorClock::time_point> next_deadline() const {
+        if (m_timers.empty()) {
+            return std::nullopt;
+        }
+
+        return m_timers.top().when;
+    }
+
+    void retire_from_group(size_t count);
+
+    void resume(Runnable runnable) {
+        for (int chain = 0; runnable && chain < k_max_next_chain; chain++) {
+            if (!runnable.handle.done()) {
+                m_current = runnable;
+                runnable.promise->budget = k_task_budget;
+
+                auto latency = m_round_start - runnable.promise->woken_at;
+                bump(m_resumes);
+                bump(m_wakeup_latency[latency_bucket(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count())]);
+
+                CORO_TRACE(ResumeStart, runnable.handle);
+                runnable.handle.resume();
+                // Not necessarily suspended in the sense of still being alive - it may have completed or migrated
+                CORO_TRACE(Suspend, runnable.handle);
+
+                m_current = {};
+            }
+
+            runnable = std::exchange(m_next, {});
+        }
+
+        // Chain limit reached - whatever's left waits its turn
+        if (runnable) {
+            enqueue(runnable);
+        }
+    }
+
+    void fire_timers() {
+        if (m_timers.empty()) {
+            return;
+        }
+
+        auto now = m_clock.now();
+
+        while (!m_timers.empty() && m_timers.top().when <= now) {
+            wakeup(m_timers.top().runnable);
+            m_timers.pop();
+        }
+    }
+
+    void collect_wakeups() {
+        std::unique_lock guard {needs_waking_mutex};
+
+        std::move(m_incoming_tasks.begin(), m_incoming_tasks.end(), std::back_inserter(m_owned_tasks));
+        m_incoming_tasks.clear();
+
+        for (int priority = 0; priority < k_num_priorities; priority++) {
+            auto& waking = m_needs_waking[priority];
+
+            if (m_shuffle_rng) {
+                std::shuffle(waking.begin(), waking.end(), *m_shuffle_rng);
+            }
+
+            // push_back rather than a range insert, which allocates a fresh block at the front every time the
+            // queue has drained under libstdc++
+            for (auto runnable : waking) {
+                m_ready[priority].push_back(runnable);
+            }
+            waking.clear();
+        }
+    }
+
+    // Safe to call from any thread. The ready queue depth is only updated once per tick.
+    ExecutorMetrics metrics() {
+        ExecutorMetrics result;
+        result.taken_at = std::chrono::steady_clock::now();
+
+        {
+            std::unique_lock guard {needs_waking_mutex};
+            for (auto&& waking : m_needs_waking) {
+                result.ready_queue_depth += waking.size();
+            }
+        }
+
+        result.ready_queue_depth += m_num_ready.load(std::memory_order_relaxed);
+        result.live_tasks = m_num_tasks.load(std::memory_order_relaxed);
+        result.resumes = m_resumes.load(std::memory_order_relaxed);
+
+        for (int bucket = 0; bucket < k_latency_buckets; bucket++) {
+            result.wakeup_latency[bucket] = m_wakeup_latency[bucket].load(std::memory_order_relaxed);
+        }
+
+        return result;
+    }
+
+    bool has_ready() const {
+        return std::any_of(m_ready.begin(), m_ready.end(), [] (auto&& queue) { return !queue.empty(); });
+    }
+};
+
+// Wake a handle on whichever executor it belongs to. Safe to call from any thread.
+inline void schedule(Runnable runnable) {
+    runnable.promise->executor->wakeup(runnable);
+}
+
+// For a handle suspending itself to let other work go first. Unlike schedule it never takes the next slot,
+// which matters for JoinTasks - they run inline inside their parent, so the executor can't tell them apart
+// from any other task being woken.
+inline void reschedule(Runnable runnable) {
+    runnable.promise->executor->requeue(runnable);
+}
+
+// Called by an await_suspend whose await could complete without suspending. Charges it to the task's budget, and
+// once that runs out, reschedules the task instead - returns whether it should suspend.
+template<class Promise>
+bool spend_budget(coroutine_handle<Promise> h) {
+    if (--h.promise().budget > 0) {
+        return false;
+    }
+
+    reschedule(h);
+    return true;
+}
+
+struct AsyncScope;
+struct ForkCounter;
+
+struct TaskPromise : ScheduledPromise, CountedFrame<FrameType::Task> {
+    ~TaskPromise();
+
+    Task get_return_object() {
+        return { coroutine_handle<TaskPromise>::from_promise(*this) };
+    }
+
+    auto initial_suspend() { return suspend_always{}; }
+    auto final_suspend();
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    AsyncScope* scope {nullptr};
+    ForkCounter* fork_counter {nullptr};
+};
+
+
+
+// A nursery that tasks can spawn children into.
+// At most `max_in_flight` children run at once - `co_await scope.spawn(t)` suspends the spawner until a slot
+// frees up, and `co_await scope.join()` suspends until every child has completed.
+// Only touched from the executor thread, so needs no locking - children must not migrate to another shard.
+struct AsyncScope {
+    AsyncScope(int max_in_flight, Priority priority = Priority::Normal)
+        : max_in_flight{max_in_flight}
+        , priority{priority}
+    {
+        // A limit below one would leave every spawner suspended forever
+        assert(max_in_flight > 0);
+    }
+    AsyncScope(AsyncScope const&) = delete;
+
+    // Children are owned by their executor, not the scope, so they are still cleaned up if the scope dies first -
+    // e.g. when an executor is destroyed while a nursery task is suspended. They just stop reporting back.
+    ~AsyncScope() {
+        for (auto child : children) {
+            child->scope = nullptr;
+        }
+    }
+
+    struct SpawnAwaitable {
+        AsyncScope* scope;
+        Task task;
+
+        Executor* executor {nullptr};
+
+        bool await_ready() { return false; }
+
+        template<class Promise>
+        bool await_suspend(coroutine_handle<Promise> h) {
+            // Children run wherever the spawner does
+            executor = h.promise().executor;
+
+            if (scope->try_acquire()) {
+                return spend_budget(h);
+            }
+
+            scope->waiting_spawners.push_back(h);
+            return true;
+        }
+        void await_resume() { scope->start(std::move(task), *executor); }
+    };
+
+    struct JoinAllAwaitable {
+        AsyncScope* scope;
+
+        bool await_ready() { return scope->in_flight == 0; }
+
+        template<class Promise>
+        void await_suspend(coroutine_handle<Promise> h) {
+            scope->joiners.push_back(h);
+        }
+        void await_resume() {}
+    };
+
+    [[nodiscard]] SpawnAwaitable spawn(Task task) { return {this, std::move(task)}; }
+    [[nodiscard]] JoinAllAwaitable join() { return {this}; }
+
+    bool try_acquire() {
+        if (in_flight < max_in_flight) {
+            in_flight++;
+            return true;
+        }
+
+        return false;
+    }
+
+    void start(Task task, Executor& executor) {
+        task.promise()->scope = this;
+        children.push_back(task.promise());
+        executor.spawn(std::move(task), priority);
+    }
+
+    // A child frame is going away without having completed
+    void forget(TaskPromise* child) {
+        std::erase(children, child);
+    }
+
+    void notify_completed(TaskPromise* child) {
+        forget(child);
+
+        // Hand the slot straight over to the oldest waiting spawner
+        if (!waiting_spawners.empty()) {
+            schedule(waiting_spawners.front());
+            waiting_spawners.pop_front();
+            return;
+        }
+
+        in_flight--;
+        if (in_flight == 0) {
+            for (auto joiner : std::exchange(joiners, {})) {
+                schedule(joiner);
+            }
+        }
+    }
+
+    int max_in_flight;
+    Priority priority;
+    int in_flight {0};
+    std::deque<Runnable> waiting_spawners;
+    std::vector<Runnable> joiners;
+    std::vector<TaskPromise*> children;
+};
+
+inline TaskPromise::~TaskPromise() {
+    if (scope) {
+        scope->forget(this);
+    }
+}
+
+inline void Executor::adopt(Task task) {
+    m_num_tasks++;
+    task.promise()->executor = this;
+
+    if (t_current_executor == this) {
+        wakeup(task.handle());
+        m_owned_tasks.push_back(std::move(task));
+        return;
+    }
+
+    CORO_TRACE(Enqueue, task.handle());
+    task.promise()->woken_at = wakeup_time();
+
+    // Tasks from other threads are only handed over to m_owned_tasks in collect_wakeups, before they can be resumed
+    std::unique_lock guard {needs_waking_mutex};
+    m_needs_waking[(int) task.promise()->priority].push_back(task.handle());
+    m_incoming_tasks.push_back(std::move(task));
+
+    if (m_parked) {
+        m_wakeup_signal.notify_one();
+    }
+}
+
+// Counts outstanding tasks forked by parallel_for/parallel_reduce, which may complete on any shard.
+// Starts with one reference held by the awaiting task itself, so it can't reach zero before everything is forked.
+struct ForkCounter {
+    void fork(Task task);
+
+    // Returns true if this released the last reference
+    bool release() {
+        return --pending == 0;
+    }
+
+    void notify_completed() {
+        if (release()) {
+            schedule(to_resume);
+        }
+    }
+
+    std::atomic<int> pending {1};
+    Runnable to_resume {};
+};
+
+inline auto TaskPromise::final_suspend() {
+    struct Awaitable {
+        bool await_ready() { return false; }
+
+        void await_suspend(coroutine_handle<TaskPromise> h) {
+            CORO_TRACE(Complete, h);
+
+            if (auto scope = std::exchange(h.promise().scope, nullptr)) {
+                scope->notify_completed(&h.promise());
+            }
+
+            if (auto counter = h.promise().fork_counter) {
+                counter->notify_completed();
+            }
+        }
+
+        void await_resume() {}
+    };
+
+    return Awaitable{};
+}
+
+
+
+
+// Moves the awaiting task onto another executor
+struct MigrateAwaitable {
+    Executor* target;
+
+    bool await_ready() { return false; }
+
+    bool await_suspend(coroutine_handle<TaskPromise> h) {
+        auto& executor = *h.promise().executor;
+        if (&executor == target) {
+            return false;
+        }
+
+        // The target may resume the task as soon as it's adopted, so h mustn't be touched after this
+        return executor.migrate(h, *target);
+    }
+
+    void await_resume() {}
+};
+
+inline MigrateAwaitable migrate_to(Executor& target) {
+    return {&target};
+}
+
+
+// One executor per hardware thread, each run on its own thread. The threads aren't pinned to cores, so the OS is
+// free to move them around. Tasks only ever run on the shard they were spawned on (wakeups from any thread are
+// routed back there) unless they explicitly co_await migrate_to another shard.
+struct ShardedExecutor {
+    ShardedExecutor(int num_shards = std::max(1u, std::thread::hardware_concurrency()))
+        : m_shards(num_shards)
+    {
+        for (auto&& shard : m_shards) {
+            shard.m_group = this;
+        }
+    }
+
+    ShardedExecutor(ShardedExecutor const&) = delete;
+
+    Executor& shard(int index) { return m_shards[index]; }
+    int num_shards() const { return (int) m_shards.size(); }
+    int index_of(Executor const& executor) const { return int(&executor - m_shards.data()); }
+
+    // Spreads tasks over the shards round robin. Safe to call from any thread.
+    void spawn(Task task, Priority priority = Priority::Normal) {
+        next_shard().spawn(std::move(task), priority);
+    }
+
+    Executor& next_shard() {
+        return m_shards[m_next_shard++ % m_shards.size()];
+    }
+
+    // Blocks until every task on every shard has completed
+    void run() {
+        if (!has_tasks()) {
+            return;
+        }
+
+        m_done = false;
+
+        std::vector<std::thread> threads;
+
+        for (auto&& shard : m_shards) {
+            threads.emplace_back([this, &shard] {
+                // Keep going until the whole group is finished, since tasks may still migrate here.
+                // Idle shards sleep until they're sent work or their next timer is due.
+                while (!m_done) {
+                    shard.run();
+                    shard.park();
+                }
+            });
+        }
+
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+    }
+
+    ExecutorMetrics metrics() {
+        ExecutorMetrics result;
+        for (auto&& shard : m_shards) {
+            result += shard.metrics();
+        }
+        return result;
+    }
+
+    bool has_tasks() const {
+        return m_live_tasks > 0;
+    }
+
+    // Called by whichever shard retires the last task, to wake the others so they can exit
+    void finish() {
+        m_done = true;
+
+        for (auto&& shard : m_shards) {
+            // Taking the lock means a shard can't miss this between checking m_done and going to sleep
+            std::unique_lock guard {shard.needs_waking_mutex};
+            shard.m_wakeup_signal.notify_all();
+        }
+    }
+
+    std::vector<Executor> m_shards;
+    std::atomic<size_t> m_next_shard {0};
+
+    // Live tasks across every shard - unlike the per shard counts, migrating a task doesn't change it
+    std::atomic<size_t> m_live_tasks {0};
+    std::atomic<bool> m_done {false};
+};
+
+inline void Executor::spawn(Task task, Priority priority) {
+    CORO_TRACE(Spawn, task.handle());
+    task.promise()->priority = priority;
+
+    if (m_group) {
+        m_group->m_live_tasks++;
+    }
+
+    adopt(std::move(task));
+}
+
+inline void Executor::retire_from_group(size_t count) {
+    if (m_group && m_group->m_live_tasks.fetch_sub(count) == count) {
+        m_group->finish();
+    }
+}
+
+inline void Executor::park() {
+    std::unique_lock guard {needs_waking_mutex};
+
+    auto has_work = [this] {
+        return has_ready()
+            || m_next
+            || !m_incoming_tasks.empty()
+            || std::any_of(m_needs_waking.begin(), m_needs_waking.end(), [] (auto&& waking) { return !waking.empty(); })
+            || (m_group && m_group->m_done);
+    };
+
+    // A simulated clock jumps straight to the next deadline in run(), so there's never anything to wait for
+    if (m_clock.is_simulated() && !m_timers.empty()) {
+        return;
+    }
+
+    m_parked = true;
+
+    if (auto deadline = next_deadline()) {
+        m_wakeup_signal.wait_until(guard, *deadline, has_work);
+    } else {
+        m_wakeup_signal.wait(guard, has_work);
+    }
+
+    m_parked = false;
+}
+
+
+
+
+inline void ForkCounter::fork(Task task) {
+    pending++;
+    task.promise()->fork_counter = this;
+
+    // Spread over the awaiting task's shard group, or kept on its executor if it isn't sharded
+    auto& home = *to_resume.promise->executor;
+    auto& target = home.m_group? home.m_group->next_shard() : home;
+    target.spawn(std::move(task), to_resume.promise->priority);
+}
+
+// Runs chunks [first_chunk, last_chunk) of a fork-join, forking off the upper half to another shard
+// until only one chunk is left to run here. Nobody waits on these tasks directly, only on the shared ForkCounter,
+// so no worker is ever blocked.
+template<class ForkJoin>
+Task fork_chunks(ForkJoin* fork_join, size_t first_chunk, size_t last_chunk) {
+    while (last_chunk - first_chunk > 1) {
+        auto mid_chunk = first_chunk + (last_chunk - first_chunk) / 2;
+        fork_join->counter.fork(fork_chunks(fork_join, mid_chunk, last_chunk));
+        last_chunk = mid_chunk;
+    }
+
+    fork_join->run_chunk(first_chunk);
+    co_return;
+}
+
+// Splits a random access range into chunks of `grain` elements, which are run as tasks spread over the shards.
+// Must stay put once awaited, since the forked tasks point back at it.
+template<class It>
+struct ForkJoinBase {
+    ForkJoinBase(It first, It last, size_t grain)
+        : first{first}
+        , size{size_t(last - first)}
+        , grain{std::max<size_t>(grain, 1)}
+        , num_chunks{(size + this->grain - 1) / this->grain}
+    {}
+
+    ForkJoinBase(ForkJoinBase const&) = delete;
+
+    bool await_ready() { return num_chunks == 0; }
+
+    std::pair<It, It> chunk(size_t index) const {
+        return {first + index*grain, first + std::min(size, (index+1)*grain)};
+    }
+
+    It first;
+    size_t size;
+    size_t grain;
+    size_t num_chunks;
+    ForkCounter counter;
+};
+
+template<class ForkJoin, class Promise>
+bool start_fork_join(ForkJoin* fork_join, coroutine_handle<Promise> h) {
+    fork_join->counter.to_resume = h;
+    fork_join->counter.fork(fork_chunks(fork_join, 0, fork_join->num_chunks));
+
+    // Every chunk may already have finished on other shards, in which case there's nothing to wait for
+    return !fork_join->counter.release();
+}
+
+template<class It, class Fn>
+struct ParallelForAwaitable : ForkJoinBase<It> {
+    ParallelForAwaitable(It first, It last, size_t grain, Fn fn)
+        : ForkJoinBase<It>{first, last, grain}
+        , fn{std::move(fn)}
+    {}
+
+    template<class Promise>
+    bool await_suspend(coroutine_handle<Promise> h) { return start_fork_join(this, h); }
+    void await_resume() {}
+
+    void run_chunk(size_t index) {
+        auto [it, end] = this->chunk(index);
+        for (; it != end; ++it) {
+            fn(*it);
+        }
+    }
+
+    Fn fn;
+};
+
+template<class It, class T, class Op>
+struct ParallelReduceAwaitable : ForkJoinBase<It> {
+    ParallelReduceAwaitable(It first, It last, size_t grain, T init, Op op)
+        : ForkJoinBase<It>{first, last, grain}
+        , init{std::move(init)}
+        , op{std::move(op)}
+        , partials{std::make_unique<std::optional<T>[]>(this->num_chunks)}
+    {}
+
+    template<class Promise>
+    bool await_suspend(coroutine_handle<Promise> h) { return start_fork_join(this, h); }
+
+    // Partials are combined in chunk order after init, so op only needs to be associative
+    T await_resume() {
+        T result = std::move(init);
+        for (size_t index = 0; index < this->num_chunks; index++) {
+            result = op(std::move(result), std::move(*partials[index]));
+        }
+        return result;
+    }
+
+    // Chunks are never empty, so each starts from its own first element rather than needing an identity for op.
+    // Accumulates into a local and stores it once, since neighbouring partials share cache lines with other shards.
+    void run_chunk(size_t index) {
+        auto [it, end] = this->chunk(index);
+        T partial = *it;
+        for (++it; it != end; ++it) {
+            partial = op(std::move(partial), *it);
+        }
+        partials[index] = std::move(partial);
+    }
+
+    T init;
+    Op op;
+
+    // One real object per chunk - a std::vector<bool> would pack neighbouring chunks into shared words
+    std::unique_ptr<std::optional<T>[]> partials;
+};
+
+// Elements per chunk when no grain is given - enough to amortise forking a task for cheap per-element work
+constexpr size_t k_default_grain = 1 << 12;
+
+// co_await parallel_for(range, grain, fn) calls fn on every element of range, from whichever shards the chunks land on
+template<class Range, class Fn>
+auto parallel_for(Range&& range, size_t grain, Fn fn) {
+    using It = decltype(std::begin(range));
+    return ParallelForAwaitable<It, Fn>{std::begin(range), std::end(range), grain, std::move(fn)};
+}
+
+// co_await parallel_reduce(range, grain, init, op) folds range into init with op, like std::reduce. op must be
+// associative, but needn't have an identity - init is only applied once.
+template<class Range, class T, class Op>
+auto parallel_reduce(Range&& range, size_t grain, T init, Op op) {
+    using It = decltype(std::begin(range));
+    return ParallelReduceAwaitable<It, T, Op>{std::begin(range), std::end(range), grain, std::move(init), std::move(op)};
+}
+
+template<class Range, class T, class Op>
+auto parallel_reduce(Range&& range, T init, Op op) {
+    return parallel_reduce(std::forward<Range>(range), k_default_grain, std::move(init), std::move(op));
+}
+
+
+
+
+struct JoinCounter {
+    JoinCounter(int c) : count{c} {}
+
+    bool is_ready() const { return (bool) to_resume; }
+    bool try_await(Runnable r) {
+        to_resume = r;
+        return count > 0;
+    }
+
+    void notify_completed() {
+        count--;
+        // Tasks that complete inline during JoinAwaitable::await_suspend finish before anyone is waiting
+        if (count == 0 && to_resume) {
+            schedule(to_resume);
+        }
+    }
+
+    int count;
+    Runnable to_resume {};
+};
+
+struct JoinTask;
+
+struct JoinPromise : ScheduledPromise, CountedFrame<FrameType::Join> {
+    JoinTask get_return_object();
+
+    auto initial_suspend() { return suspend_always{}; }
+    auto final_suspend() {
+        struct Awaitable {
+            bool await_ready() { return false; }
+
+            void await_suspend(coroutine_handle<JoinPromise> h) {
+                CORO_TRACE(Complete, h);
+                h.promise().counter->notify_completed();
+            }
+
+            void await_resume() {}
+        };
+
+        return Awaitable{};
+    }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    JoinCounter* counter {nullptr};
+};
+
+struct JoinTask {
+    using promise_type = JoinPromise;
+
+    JoinTask(coroutine_handle<JoinPromise> h) : handle{h} {}
+
+    void start(JoinCounter* counter, ScheduledPromise const& parent) {
+        handle.promise()->counter = counter;
+        handle.promise()->priority = parent.priority;
+        handle.promise()->executor = parent.executor;
+        handle.resume();
+    }
+
+    OwnedHandle<JoinPromise> handle;
+};
+
+inline JoinTask JoinPromise::get_return_object() {
+    return { coroutine_handle<JoinPromise>::from_promise(*this) };
+}
+
+
+template<class Awaitable>
+JoinTask make_join_task(Awaitable&& awaitable) {
+    co_await std::forward<Awaitable>(awaitable);
+}
+
+
+template<int N>
+struct JoinAwaitable {
+    JoinAwaitable(std::array<JoinTask, N> ts)
+        : tasks{std::move(ts)}
+        , counter{N}
+    {}
+
+    bool await_ready() { return counter.is_ready(); }
+
+    template<class Promise>
+    bool await_suspend(coroutine_handle<Promise> h) {
+        for (auto&& task : tasks) {
+            task.start(&counter, h.promise());
+        }
+
+        if (!counter.try_await(h)) {
+            return spend_budget(h);
+        }
+
+        return true;
+    }
+
+    void await_resume() {}
+
+    std::array<JoinTask, N> tasks;
+    JoinCounter counter;
+};
+
+template<class... Awaitable>
+auto join(Awaitable&&... awaitable) {
+    return JoinAwaitable<sizeof...(Awaitable)> {{
+        make_join_task(std::forward<Awaitable>(awaitable)) ...
+    }};
+}
+
+
+
+
+// A cooperative yield point - always goes to the back of the queue
+struct BasicAwaitable {
+    bool await_ready() { return false; }
+
+    template<class Promise>
+    void await_suspend(coroutine_handle<Promise> h) {
+        reschedule(h);
+    }
+    void await_resume() {}
+};
+
+// Goes by the clock of the executor the awaiting task belongs to. The deadline is only resolved once awaited,
+// so it can be created anywhere - e.g. as an argument to join() before any executor is running.
+struct TimedAwaitable {
+    ExecutorClock::duration delay;
+
+    TimedAwaitable(ExecutorClock::duration d) : delay{d} {}
+
+    bool await_ready() { return false; }
+
+    template<class Promise>
+    bool await_suspend(coroutine_handle<Promise> h) {
+        if (delay <= ExecutorClock::duration::zero()) {
+            return spend_budget(h);
+        }
+
+        auto& executor = *h.promise().executor;
+        executor.add_timer(executor.now() + delay, h);
+        return true;
+    }
+    void await_resume() {}
+};
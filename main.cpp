@@ -7,11 +7,27 @@
 void test_generator();
 void test_simple_awaitable();
 void test_executor();
+void test_executor_nursery();
+void test_executor_priority();
+void test_executor_handoff();
+void test_sharded_executor();
+void test_parallel();
+void test_executor_trace();
+void test_executor_metrics();
+void test_executor_simulated();
 void test_symmetric();
 
 int main() {
     test_generator();
     // test_simple_awaitable();
     // test_executor();
+    // test_executor_nursery();
+    // test_executor_priority();
+    // test_executor_handoff();
+    // test_sharded_executor();
+    // test_parallel();
+    // test_executor_trace();
+    // test_executor_metrics();
+    // test_executor_simulated();
     test_symmetric();
 }
\ No newline at end of file
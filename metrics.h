@@ -0,0 +1,186 @@
+#pragma once
+
+#include "common.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <bit>
+#include <cstdint>
+
+// Runtime counters for the executor. Every counter has a single writing thread, so bumping one is a plain
+// relaxed load and store with no contention - readers pay for aggregating them when taking a snapshot.
+
+template<class T>
+void bump(std::atomic<T>& counter, T amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+
+// Bucket i counts latencies in [2^(i-1), 2^i) nanoseconds, with everything over ~1s in the last bucket
+constexpr int k_latency_buckets = 32;
+
+inline int latency_bucket(uint64_t ns) {
+    return std::min<int>(std::bit_width(ns), k_latency_buckets - 1);
+}
+
+using LatencyHistogram = std::array<uint64_t, k_latency_buckets>;
+
+// Upper bound of the bucket the given fraction of samples falls under
+inline uint64_t latency_percentile_ns(LatencyHistogram const& histogram, double fraction) {
+    uint64_t total = std::accumulate(histogram.begin(), histogram.end(), uint64_t{0});
+    uint64_t target = uint64_t(fraction * total);
+    uint64_t seen = 0;
+
+    for (int bucket = 0; bucket < k_latency_buckets; bucket++) {
+        seen += histogram[bucket];
+        if (seen > target) {
+            return uint64_t{1} << bucket;
+        }
+    }
+
+    return 0;
+}
+
+
+struct ExecutorMetrics {
+    std::chrono::steady_clock::time_point taken_at;
+
+    size_t ready_queue_depth {0};
+    size_t live_tasks {0};
+    uint64_t resumes {0};
+    LatencyHistogram wakeup_latency {};
+
+    double resumes_per_second(ExecutorMetrics const& earlier) const {
+        std::chrono::duration<double> elapsed = taken_at - earlier.taken_at;
+        return elapsed.count() > 0.0? (resumes - earlier.resumes) / elapsed.count() : 0.0;
+    }
+
+    ExecutorMetrics& operator+=(ExecutorMetrics const& o) {
+        taken_at = std::max(taken_at, o.taken_at);
+        ready_queue_depth += o.ready_queue_depth;
+        live_tasks += o.live_tasks;
+        resumes += o.resumes;
+        for (int bucket = 0; bucket < k_latency_buckets; bucket++) {
+            wakeup_latency[bucket] += o.wakeup_latency[bucket];
+        }
+        return *this;
+    }
+};
+
+
+
+// Coroutine frame allocations, counted per promise type
+enum class FrameType {
+    Task,
+    Join,
+};
+
+constexpr int k_num_frame_types = 2;
+constexpr std::array<const char*, k_num_frame_types> k_frame_type_names {"task", "join"};
+
+struct FrameCounters {
+    std::atomic<uint64_t> allocations {0};
+    std::atomic<uint64_t> frees {0};
+    std::atomic<uint64_t> bytes_allocated {0};
+    std::atomic<uint64_t> bytes_freed {0};
+};
+
+struct FrameMetrics {
+    uint64_t allocations {0};
+    uint64_t frees {0};
+    uint64_t bytes_allocated {0};
+    uint64_t bytes_freed {0};
+
+    uint64_t live_frames() const { return allocations - frees; }
+    uint64_t live_bytes() const { return bytes_allocated - bytes_freed; }
+};
+
+// Owns every thread's counters, so frames allocated by threads that have since exited are still accounted for.
+// Counters only ever accumulate, so a thread's set is handed on to the next new thread once it exits rather than
+// the registry growing with every thread ever started.
+struct FrameCounterRegistry {
+    std::array<FrameCounters, k_num_frame_types>* register_thread() {
+        std::unique_lock guard {mutex};
+
+        if (!free_counters.empty()) {
+            auto thread_counters = free_counters.back();
+            free_counters.pop_back();
+            return thread_counters;
+        }
+
+        return counters.emplace_back(std::make_unique<std::array<FrameCounters, k_num_frame_types>>()).get();
+    }
+
+    void release_thread(std::array<FrameCounters, k_num_frame_types>* thread_counters) {
+        std::unique_lock guard {mutex};
+        free_counters.push_back(thread_counters);
+    }
+
+    std::array<FrameMetrics, k_num_frame_types> snapshot() {
+        std::unique_lock guard {mutex};
+
+        std::array<FrameMetrics, k_num_frame_types> result {};
+        for (auto&& thread_counters : counters) {
+            for (int type = 0; type < k_num_frame_types; type++) {
+                auto& c = (*thread_counters)[type];
+                result[type].allocations += c.allocations.load(std::memory_order_relaxed);
+                result[type].frees += c.frees.load(std::memory_order_relaxed);
+                result[type].bytes_allocated += c.bytes_allocated.load(std::memory_order_relaxed);
+                result[type].bytes_freed += c.bytes_freed.load(std::memory_order_relaxed);
+            }
+        }
+
+        return result;
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::array<FrameCounters, k_num_frame_types>>> counters;
+    std::vector<std::array<FrameCounters, k_num_frame_types>*> free_counters;
+};
+
+inline FrameCounterRegistry g_frame_counters;
+
+// Gives the thread's counters back to the registry when the thread exits
+struct ThreadFrameCounters {
+    ~ThreadFrameCounters() {
+        if (counters) {
+            g_frame_counters.release_thread(counters);
+        }
+    }
+
+    std::array<FrameCounters, k_num_frame_types>* counters {nullptr};
+};
+
+inline thread_local ThreadFrameCounters t_frame_counters;
+
+inline FrameCounters& thread_frame_counters(FrameType type) {
+    if (!t_frame_counters.counters) {
+        t_frame_counters.counters = g_frame_counters.register_thread();
+    }
+
+    return (*t_frame_counters.counters)[(int) type];
+}
+
+inline std::array<FrameMetrics, k_num_frame_types> frame_metrics() {
+    return g_frame_counters.snapshot();
+}
+
+// Promise base that counts its coroutine frames through the promise operator new hook
+template<FrameType Type>
+struct CountedFrame {
+    void* operator new(std::size_t sz) {
+        auto& counters = thread_frame_counters(Type);
+        bump(counters.allocations);
+        bump(counters.bytes_allocated, uint64_t(sz));
+        return ::operator new(sz);
+    }
+
+    void operator delete(void* ptr, std::size_t sz) {
+        auto& counters = thread_frame_counters(Type);
+        bump(counters.frees);
+        bump(counters.bytes_freed, uint64_t(sz));
+        ::operator delete(ptr);
+    }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+
+template<class Yields>
+struct SymmetricCoroutinePromiseYieldBase;
+template<class Accepts>
+struct SymmetricCoroutinePromiseAcceptBase;
+
+template<class Yields, class Accepts>
+struct SymmetricCoroutinePromise;
+
+template<class Yields, class Accepts>
+struct SymmetricCoroutine {
+    using promise_type = SymmetricCoroutinePromise<Yields, Accepts>;
+
+    SymmetricCoroutine(coroutine_handle<promise_type> handle) : m_handle{handle} {}
+
+    bool run() {
+        if (m_handle.valid() && !m_handle.done()) {
+            m_handle.resume();
+            return true;
+        }
+
+        return false;
+    }
+
+    template<class TargetYields>
+    void set_target(coroutine_handle<SymmetricCoroutinePromise<TargetYields, Yields>> next_coro) {
+        m_handle.promise()->next_coro = next_coro;
+    }
+
+    coroutine_handle<promise_type> handle() { return m_handle.as_unowned(); }
+
+private:
+    OwnedHandle<promise_type> m_handle;
+};
+
+
+
+template<class Promise>
+struct PassControlAwaitable {
+    Promise* promise;
+
+    bool await_ready() {
+        // return promise->prev_coro && promise->prev_coro.promise().value;
+        return false;
+    }
+
+    coroutine_handle<> await_suspend(coroutine_handle<> h) {
+        if (promise->next_coro && !promise->next_coro.done()) {
+            // :'(
+            using NextPromise = SymmetricCoroutinePromise<int, typename Promise::YieldType>;
+            auto next_handle_addr = promise->next_coro.address();
+            auto next_handle = coroutine_handle<NextPromise>::from_address(next_handle_addr);
+
+            next_handle.promise().prev_coro = h;
+            return promise->next_coro;
+        }
+
+        return noop_coroutine();
+    }
+
+    std::optional<typename Promise::AcceptType> await_resume() {
+        if (promise->prev_coro) {
+            // :'(
+            using PrevPromise = SymmetricCoroutinePromise<typename Promise::AcceptType, int>;
+            auto prev_promise_addr = promise->prev_coro.address();
+            auto prev_promise = coroutine_handle<PrevPromise>::from_address(prev_promise_addr);
+
+            return std::move(prev_promise.promise().value);
+        }
+
+        return std::nullopt;
+    }
+};
+
+
+template<class Yields, class Accepts>
+struct SymmetricCoroutinePromise {
+    using YieldType = Yields;
+    using AcceptType = Accepts;
+
+    coroutine_handle<>              next_coro {};
+    coroutine_handle<>              prev_coro {};
+    std::optional<Yields>           value {std::nullopt};
+
+    auto initial_suspend() { return std::experimental::suspend_always{}; }
+    auto final_suspend() { return std::experimental::suspend_always{}; }
+
+    void unhandled_exception() { std::terminate(); }
+
+    void return_void() {
+        this->value.reset();
+    }
+
+    auto yield_value(Yields t) {
+        this->value = std::move(t);
+        return PassControlAwaitable<SymmetricCoroutinePromise> { this };
+    }
+
+    SymmetricCoroutine<Yields, Accepts> get_return_object() {
+        return { coroutine_handle<SymmetricCoroutinePromise>::from_promise(*this) };
+    }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "common.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+// Executor instrumentation. Build with -DCORO_TRACING to record events, otherwise CORO_TRACE compiles to nothing.
+// Events go into a ring buffer per thread, and can be written out with dump_chrome_trace for viewing in
+// chrome://tracing or Perfetto.
+
+#ifdef CORO_TRACING
+#define CORO_TRACE(event, handle) trace_record(TraceEvent::event, (handle).address())
+#else
+#define CORO_TRACE(event, handle) ((void) 0)
+#endif
+
+enum class TraceEvent : uint8_t {
+    Spawn,
+    Enqueue,
+    ResumeStart,
+    Suspend,
+    Complete,
+};
+
+struct TraceRecord {
+    uint64_t timestamp_ns;
+    void* task;
+    TraceEvent event;
+};
+
+// Only ever written by its own thread. Once full, the oldest records are overwritten.
+struct TraceBuffer {
+    static constexpr size_t k_capacity = 1 << 16;
+
+    TraceBuffer(int thread_id) : thread_id{thread_id}, records(k_capacity) {}
+
+    void push(TraceRecord record) {
+        auto index = head.load(std::memory_order_relaxed);
+        records[index % k_capacity] = record;
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    int thread_id;
+    std::atomic<size_t> head {0};
+    std::vector<TraceRecord> records;
+};
+
+// Owns every thread's buffer, so traces from threads that have since exited can still be dumped.
+// A thread's buffer is handed on to the next new thread once it exits, so starting threads over and over (e.g. a
+// ShardedExecutor run in a loop) doesn't grow the registry. Threads sharing a buffer never overlap in time, so
+// they just end up on the same track.
+struct TraceRegistry {
+    TraceBuffer* register_thread() {
+        std::unique_lock guard {mutex};
+
+        if (!free_buffers.empty()) {
+            auto buffer = free_buffers.back();
+            free_buffers.pop_back();
+            return buffer;
+        }
+
+        return buffers.emplace_back(std::make_unique<TraceBuffer>((int) buffers.size())).get();
+    }
+
+    void release_thread(TraceBuffer* buffer) {
+        std::unique_lock guard {mutex};
+        free_buffers.push_back(buffer);
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    std::vector<TraceBuffer*> free_buffers;
+};
+
+inline TraceRegistry g_trace_registry;
+
+// Gives the thread's buffer back to the registry when the thread exits
+struct ThreadTraceBuffer {
+    ~ThreadTraceBuffer() {
+        if (buffer) {
+            g_trace_registry.release_thread(buffer);
+        }
+    }
+
+    TraceBuffer* buffer {nullptr};
+};
+
+inline thread_local ThreadTraceBuffer t_trace_buffer;
+
+inline void trace_record(TraceEvent event, void* task) {
+    if (!t_trace_buffer.buffer) {
+        t_trace_buffer.buffer = g_trace_registry.register_thread();
+    }
+
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    t_trace_buffer.buffer->push({(uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(), task, event});
+}
+
+// Writes everything recorded so far as Chrome trace event JSON.
+// Running tasks show up as slices on the thread that resumed them, and time spent in a ready queue as an async
+// "queued" slice per task. Should only be called while no executor is running.
+inline void dump_chrome_trace(FILE* file) {
+    std::unique_lock guard {g_trace_registry.mutex};
+
+    std::fputs("{\"traceEvents\": [\n", file);
+
+    const char* separator = "";
+
+    for (auto&& buffer : g_trace_registry.buffers) {
+        size_t end = buffer->head.load(std::memory_order_acquire);
+        size_t begin = end > TraceBuffer::k_capacity? end - TraceBuffer::k_capacity : 0;
+
+        for (size_t i = begin; i < end; i++) {
+            auto& record = buffer->records[i % TraceBuffer::k_capacity];
+            double ts = record.timestamp_ns / 1000.0;
+
+            const char* name = "";
+            const char* phase = "";
+
+            switch (record.event) {
+            case TraceEvent::Spawn:         name = "spawn"; phase = "i"; break;
+            case TraceEvent::Enqueue:       name = "queued"; phase = "b"; break;
+            case TraceEvent::ResumeStart:   name = "queued"; phase = "e"; break;
+            case TraceEvent::Suspend:       name = "running"; phase = "E"; break;
+            case TraceEvent::Complete:      name = "complete"; phase = "i"; break;
+            }
+
+            std::fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"task\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": 0, \"tid\": %d, \"id\": \"%p\", \"args\": {\"task\": \"%p\"}}",
+                separator, name, phase, ts, buffer->thread_id, record.task, record.task);
+            separator = ",\n";
+
+            // A resume both ends the queued slice and begins the running one
+            if (record.event == TraceEvent::ResumeStart) {
+                std::fprintf(file, ",\n{\"name\": \"running\", \"cat\": \"task\", \"ph\": \"B\", \"ts\": %.3f, \"pid\": 0, \"tid\": %d, \"args\": {\"task\": \"%p\"}}",
+                    ts, buffer->thread_id, record.task);
+            }
+        }
+    }
+
+    std::fputs("\n]}\n", file);
+}